@@ -0,0 +1,71 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "protocol.h"
+
+/*
+ * -- capture files --
+ *
+ * The server can write every frame it receives into a file (./server -c
+ * <file>) and the replay tool plays that file back against a server. That
+ * way two builds can be compared on exactly the same traffic.
+ *
+ * The file starts with the 8 byte magic "WSCAP001" followed by records:
+ *
+ *  u8      kind      CAPTURE_OPEN, CAPTURE_FRAME or CAPTURE_CLOSE
+ *  varint  delta_us  microseconds since the previous record
+ *  varint  conn      connection id, the same the server uses for presence
+ *  frame             only for CAPTURE_FRAME, the frame exactly as received
+ *                    (header + payload, the header tells the length)
+ *
+ * varints are unsigned LEB128, 7 bits per byte, lowest bits first. Most
+ * records are a few ms apart and the ids are small, so the overhead per frame
+ * is usually 4 - 6 bytes.
+ */
+#define CAPTURE_MAGIC "WSCAP001"
+#define CAPTURE_MAGIC_LEN 8
+
+enum capture_kind {
+    CAPTURE_OPEN = 0,
+    CAPTURE_FRAME = 1,
+    CAPTURE_CLOSE = 2,
+};
+
+struct capture_writer {
+    FILE *f;
+    uint64_t last_us;
+};
+
+struct capture_event {
+    enum capture_kind kind;
+    uint64_t time_us; // since the first record
+    uint32_t conn;
+    uint16_t type;    // only for CAPTURE_FRAME
+    uint32_t len;
+    const unsigned char *frame; // header + payload, valid until the next read
+};
+
+struct capture_reader {
+    FILE *f;
+    uint64_t time_us;
+    int first;
+    struct bytebuf frame;
+};
+
+int capture_open(struct capture_writer *w, const char *path);
+void capture_record(struct capture_writer *w, enum capture_kind kind,
+                    uint32_t conn, const void *frame, size_t len);
+void capture_close(struct capture_writer *w);
+
+int capture_reader_open(struct capture_reader *r, const char *path);
+/*
+ * Returns 1 and fills ev if there was a record, 0 at the end of the file and
+ * -1 if the file is broken.
+ */
+int capture_read(struct capture_reader *r, struct capture_event *ev);
+void capture_reader_close(struct capture_reader *r);
+
+#endif
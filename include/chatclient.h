@@ -0,0 +1,92 @@
+#ifndef CHATCLIENT_H_
+#define CHATCLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * -- chatclient --
+ *
+ * A small client library for the chat server. One chat_loop drives any
+ * number of sessions (and other fds like stdin) from a single poll() call,
+ * nothing in here ever blocks except the name lookup in chat_session_new().
+ *
+ * - Sending only puts the frame into the session's send queue. Everything
+ *   that piled up is written with one send() when the socket is writable, so
+ *   ten messages sent in a row usually end up as one write.
+ * - If the connection drops the session reconnects on its own, waiting a bit
+ *   longer after every failed attempt. Frames that were queued but not fully
+ *   written are sent again after the reconnect, starting with a fresh hello.
+ */
+
+struct chat_loop;
+struct chat_session;
+
+struct chat_callbacks {
+    // connected and hello is queued, a roster will follow
+    void (*on_connect)(struct chat_session *s, void *user);
+    // the connection is gone, the session will try again on its own
+    void (*on_disconnect)(struct chat_session *s, void *user);
+    void (*on_message)(struct chat_session *s, const struct chatMessage *msg,
+                       void *user);
+    void (*on_join)(struct chat_session *s, uint32_t id, const char *username,
+                    void *user);
+    void (*on_leave)(struct chat_session *s, uint32_t id, void *user);
+    void (*on_typing)(struct chat_session *s, uint32_t id, int typing,
+                      void *user);
+};
+
+// first retry after this many ms, doubling after every failure up to the max
+#define CHAT_BACKOFF_MIN_MS 100
+#define CHAT_BACKOFF_MAX_MS 30000
+
+// chat_send_*() fail once this much is waiting to be sent
+#define CHAT_MAX_QUEUE (1024 * 1024)
+
+struct chat_loop *chat_loop_new(void);
+void chat_loop_free(struct chat_loop *loop);
+
+/*
+ * Runs the loop once, waiting at most timeout_ms (-1 means until something
+ * happens). Returns -1 if poll() failed.
+ */
+int chat_loop_run_once(struct chat_loop *loop, int timeout_ms);
+// runs until chat_loop_stop() is called
+int chat_loop_run(struct chat_loop *loop);
+void chat_loop_stop(struct chat_loop *loop);
+
+/*
+ * Calls cb whenever fd is readable. Only meant for a handful of fds like
+ * stdin, sessions are tracked on their own.
+ */
+int chat_loop_watch_fd(struct chat_loop *loop, int fd,
+                       void (*cb)(int fd, void *user), void *user);
+void chat_loop_unwatch_fd(struct chat_loop *loop, int fd);
+
+/*
+ * Looks up host and starts connecting in the background. Returns NULL if the
+ * host can't be resolved or we are out of memory.
+ */
+struct chat_session *chat_session_new(struct chat_loop *loop, const char *host,
+                                      const char *port, const char *username,
+                                      const struct chat_callbacks *cb,
+                                      void *user);
+void chat_session_free(struct chat_session *s);
+
+int chat_session_connected(const struct chat_session *s);
+const char *chat_session_username(const struct chat_session *s);
+// bytes that are queued but not written yet
+size_t chat_session_pending(const struct chat_session *s);
+
+int chat_send_message(struct chat_session *s, const char *text);
+int chat_send_typing(struct chat_session *s, int typing);
+/*
+ * Queues any frame as is, for tools like replay that already have the raw
+ * frames. The hello is still sent by the library on every connect.
+ */
+int chat_send_frame(struct chat_session *s, uint16_t type, const void *payload,
+                    uint32_t len);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PRESENCE_H_
+#define PRESENCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * -- presence --
+ *
+ * Who is in the room and who is typing. Sending a message for every single
+ * join/leave would mean that when N clients reconnect after a restart every
+ * one of them gets told about the other N - 1 one by one, so N^2 messages.
+ *
+ * Instead events are only recorded here and presence_flush() is called once
+ * per tick. It sends one delta to everyone who was already in the room and
+ * one full roster to everyone who joined during the tick. Things that cancel
+ * out inside a tick (join + leave, typing + stopped typing) are not sent at
+ * all.
+ */
+
+struct presence_member {
+    int fd;
+    uint32_t id;
+    char username[USERNAME_LEN];
+    int announced;   // the others have been told that we joined
+    int typing;      // what the client told us
+    int typing_sent; // what the others were told last
+};
+
+struct presence {
+    struct presence_member *members;
+    size_t count;
+    size_t size;
+
+    // members[by_fd[fd] - 1], 0 means that fd has not joined
+    size_t *by_fd;
+    size_t by_fd_size;
+
+    // ids of announced members that left since the last flush
+    uint32_t *left;
+    size_t left_count;
+    size_t left_size;
+
+    int pending;
+    struct bytebuf out;
+};
+
+void presence_init(struct presence *p);
+void presence_free(struct presence *p);
+
+// returns -1 if we ran out of memory, joining twice is not an error
+int presence_join(struct presence *p, int fd, uint32_t id,
+                  const char *username);
+void presence_leave(struct presence *p, int fd);
+void presence_set_typing(struct presence *p, int fd, int typing);
+
+/*
+ * Hands the coalesced delta / roster to send_to() and forgets the recorded
+ * events. Does nothing when nothing happened since the last flush.
+ * send_to() must not block, one client that stops reading would otherwise
+ * stop the whole server.
+ */
+void presence_flush(struct presence *p,
+                    int (*send_to)(int fd, const void *buf, size_t len));
+
+#endif
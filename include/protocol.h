@@ -0,0 +1,117 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PORT "3490"
+
+/*
+ * Everything on the wire is a frame: a 6 byte header followed by `length`
+ * bytes of payload. All integers are in network byte order (big endian).
+ *
+ *  +-----------+--------------+------------------+
+ *  | type u16  | length u32   | payload ...      |
+ *  +-----------+--------------+------------------+
+ *
+ * TCP is a stream, so one recv() can hand us half a frame or three frames at
+ * once. The receiver buffers bytes and uses proto_parse_frame() to cut them
+ * into whole frames.
+ */
+#define PROTO_HDR_LEN 6
+
+enum proto_type {
+    PROTO_HELLO = 1,    // client -> server, payload is the username
+    PROTO_CHAT = 2,     // both ways, payload is a struct chatMessage
+    PROTO_TYPING = 3,   // client -> server, payload is one byte (1 or 0)
+    PROTO_PRESENCE = 4, // server -> client, coalesced join/leave/typing delta
+};
+
+#define USERNAME_LEN 32
+#define MESSAGE_LEN 256
+
+struct chatMessage {
+    char username[USERNAME_LEN];
+    char message[MESSAGE_LEN];
+};
+
+/*
+ * The biggest frame a client is allowed to send us. Presence frames from the
+ * server can be a lot bigger (a roster of the whole room), so clients must not
+ * assume this limit for what they receive.
+ */
+#define PROTO_MAX_CLIENT_FRAME (PROTO_HDR_LEN + sizeof(struct chatMessage))
+
+/*
+ * A growable byte buffer, used for building outgoing frames and for
+ * collecting incoming bytes until a whole frame is there.
+ */
+struct bytebuf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+int bytebuf_reserve(struct bytebuf *b, size_t extra);
+int bytebuf_append(struct bytebuf *b, const void *src, size_t n);
+int bytebuf_put_u8(struct bytebuf *b, uint8_t v);
+int bytebuf_put_u16(struct bytebuf *b, uint16_t v);
+int bytebuf_put_u32(struct bytebuf *b, uint32_t v);
+void bytebuf_consume(struct bytebuf *b, size_t n);
+void bytebuf_free(struct bytebuf *b);
+
+uint16_t proto_get_u16(const unsigned char *p);
+uint32_t proto_get_u32(const unsigned char *p);
+
+/*
+ * proto_frame_begin() writes a header with a zero length and returns where the
+ * frame starts, proto_frame_end() patches in the length once the payload has
+ * been appended.
+ */
+int proto_frame_begin(struct bytebuf *b, uint16_t type, size_t *start);
+void proto_frame_end(struct bytebuf *b, size_t start);
+int proto_append_frame(struct bytebuf *b, uint16_t type, const void *payload,
+                       uint32_t len);
+
+/*
+ * Looks at the start of buf for a whole frame.
+ * Returns the size of the frame (header + payload) if it is complete, 0 if we
+ * need more bytes.
+ */
+size_t proto_parse_frame(const unsigned char *buf, size_t len, uint16_t *type,
+                         const unsigned char **payload, uint32_t *plen);
+
+int send_all(int fd, const void *buf, size_t len);
+int send_frame(int fd, uint16_t type, const void *payload, uint32_t len);
+
+/*
+ * -- presence payload --
+ *
+ *  u32 join_count
+ *  join_count x { u32 id, u8 name_len, name bytes }
+ *  idset left
+ *  idset typing (started typing)
+ *  idset idle   (stopped typing)
+ *
+ * An idset is either a plain list or a bitmap, whatever is smaller:
+ *  u8 0 (list),   u32 count, count x u32 id
+ *  u8 1 (bitmap), u32 base,  u32 nbits, (nbits + 7) / 8 bytes
+ * In the bitmap bit i (LSB first) means id base + i is in the set. After a
+ * reconnect storm the ids are mostly contiguous so the bitmap wins by a lot.
+ */
+#define PROTO_IDSET_LIST 0
+#define PROTO_IDSET_BITMAP 1
+
+struct presence_visitor {
+    void (*on_join)(void *ctx, uint32_t id, const char *username);
+    void (*on_leave)(void *ctx, uint32_t id);
+    void (*on_typing)(void *ctx, uint32_t id, int typing);
+};
+
+// ids have to be sorted ascending
+int proto_put_idset(struct bytebuf *b, const uint32_t *ids, size_t n);
+int proto_decode_presence(const unsigned char *p, size_t len,
+                          const struct presence_visitor *v, void *ctx);
+
+#endif
@@ -5,6 +5,7 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -17,11 +18,14 @@
 #include <arpa/inet.h>
 
 #include <errno.h>
+#include <time.h>
 
 void *valid_ll_servinfo(struct addrinfo *linked_list);
 void show_usage(char *program_name);
 void sigchld_handler(int s);
 void *get_in_addr(struct sockaddr *sa);
 char *custom_getline(void);
+long now_ms(void);
+uint64_t now_us(void);
 
 #endif
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/chatclient.h"
+#include "../include/utils.h"
+
+// give up if nobody joined anything for this long while we wait for the room
+#define JOIN_TIMEOUT_MS 5000
+
+/*
+ * -- bench --
+ *
+ * Starts a bunch of bot sessions in one process, waits until every bot sees
+ * every other bot in the room and then lets each of them send a few
+ * messages. Every message carries the time it was queued, so the receivers
+ * can tell how long it took to get through the server.
+ *
+ * Usage: bench [host] [sessions] [messages per session] [ms between messages]
+ */
+
+struct bot {
+    struct chat_session *session;
+    char name[USERNAME_LEN];
+    size_t joins;
+    int sent;
+    long next_send;
+};
+
+struct stats {
+    size_t ready;
+    uint64_t joins;
+    long last_join;
+    uint64_t received;
+    uint64_t latency_sum_us;
+    uint64_t latency_max_us;
+    long last_receive;
+};
+
+size_t bot_count;
+struct stats stats;
+
+void on_connect(struct chat_session *s, void *user)
+{
+    (void)s;
+    struct bot *bot = user;
+    // a reconnect means the roster starts over
+    if (bot->joins >= bot_count)
+        stats.ready--;
+    bot->joins = 0;
+}
+
+void on_join(struct chat_session *s, uint32_t id, const char *username,
+             void *user)
+{
+    (void)s;
+    (void)id;
+    (void)username;
+    struct bot *bot = user;
+    stats.joins++;
+    stats.last_join = now_ms();
+    if (++bot->joins == bot_count)
+        stats.ready++;
+}
+
+void on_message(struct chat_session *s, const struct chatMessage *msg,
+                void *user)
+{
+    (void)s;
+    (void)user;
+    uint64_t sent = strtoull(msg->message, NULL, 10);
+    uint64_t latency = now_us() - sent;
+
+    stats.received++;
+    stats.latency_sum_us += latency;
+    if (latency > stats.latency_max_us)
+        stats.latency_max_us = latency;
+    stats.last_receive = now_ms();
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct chat_callbacks callbacks = {
+        .on_connect = on_connect,
+        .on_message = on_message,
+        .on_join = on_join,
+    };
+
+    if (argc < 4 || argc > 5) {
+        printf("Usage: \e[1m%s [server host address] [sessions] [messages per "
+               "session] [ms between messages]\e[0m\n",
+               argv[0]);
+        exit(1);
+    }
+
+    bot_count = strtoul(argv[2], NULL, 10);
+    int messages = atoi(argv[3]);
+    long interval = argc == 5 ? atol(argv[4]) : 0;
+
+    if (bot_count == 0 || messages < 0 || interval < 0) {
+        fprintf(stderr, "bench: sessions has to be > 0, the rest >= 0\n");
+        exit(1);
+    }
+
+    srand(time(NULL) ^ getpid());
+
+    struct chat_loop *loop = chat_loop_new();
+    struct bot *bots = calloc(bot_count, sizeof(*bots));
+    if (loop == NULL || bots == NULL) {
+        perror("bench: malloc");
+        exit(1);
+    }
+
+    long start = now_ms();
+    for (size_t i = 0; i < bot_count; i++) {
+        snprintf(bots[i].name, sizeof(bots[i].name), "bot%zu", i);
+        bots[i].session = chat_session_new(loop, argv[1], PORT, bots[i].name,
+                                           &callbacks, &bots[i]);
+        if (bots[i].session == NULL)
+            exit(1);
+    }
+
+    printf("bench: waiting for %zu sessions to join\n", bot_count);
+    stats.last_join = now_ms();
+    while (stats.ready < bot_count) {
+        if (now_ms() - stats.last_join >= JOIN_TIMEOUT_MS) {
+            if (stats.joins == 0)
+                fprintf(stderr, "bench: could not reach server at %s\n",
+                        argv[1]);
+            else
+                fprintf(stderr, "bench: only %zu of %zu sessions joined\n",
+                        stats.ready, bot_count);
+            exit(1);
+        }
+        if (chat_loop_run_once(loop, 100) == -1)
+            exit(1);
+    }
+    long joined = now_ms();
+    printf("bench: all sessions joined after %ld ms\n", joined - start);
+
+    uint64_t expected = (uint64_t)bot_count * messages * (bot_count - 1);
+    long send_start = now_ms();
+    long now = send_start;
+    int sending = messages > 0;
+    stats.last_receive = now;
+
+    // stop once everything arrived or nothing came in for 2 seconds
+    while (sending || (stats.received < expected &&
+                       now - stats.last_receive < 2000)) {
+        if (chat_loop_run_once(loop, sending ? 1 : 100) == -1)
+            exit(1);
+        now = now_ms();
+
+        sending = 0;
+        for (size_t i = 0; i < bot_count; i++) {
+            struct bot *bot = &bots[i];
+            if (bot->sent == messages)
+                continue;
+            sending = 1;
+            if (bot->next_send > now)
+                continue;
+
+            char text[32];
+            snprintf(text, sizeof(text), "%llu\n",
+                     (unsigned long long)now_us());
+            if (chat_send_message(bot->session, text) == 0) {
+                bot->sent++;
+                bot->next_send = now + interval;
+            }
+        }
+    }
+
+    long elapsed = now_ms() - send_start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("bench: sent %llu, received %llu of %llu in %ld ms\n",
+           (unsigned long long)bot_count * messages,
+           (unsigned long long)stats.received, (unsigned long long)expected,
+           elapsed);
+    printf("bench: %.0f deliveries/s\n", stats.received * 1000.0 / elapsed);
+    if (stats.received > 0) {
+        printf("bench: latency avg %.3f ms, max %.3f ms\n",
+               stats.latency_sum_us / 1000.0 / stats.received,
+               stats.latency_max_us / 1000.0);
+    }
+
+    chat_loop_free(loop);
+    free(bots);
+
+    return stats.received == expected ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "../include/capture.h"
+#include "../include/utils.h"
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF)
+            return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+int capture_open(struct capture_writer *w, const char *path)
+{
+    w->f = fopen(path, "wb");
+    if (w->f == NULL)
+        return -1;
+
+    // the server writes lots of small records, give stdio a bigger buffer
+    setvbuf(w->f, NULL, _IOFBF, 1 << 16);
+
+    w->last_us = now_us();
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, w->f) !=
+        CAPTURE_MAGIC_LEN) {
+        fclose(w->f);
+        w->f = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void capture_record(struct capture_writer *w, enum capture_kind kind,
+                    uint32_t conn, const void *frame, size_t len)
+{
+    if (w->f == NULL)
+        return;
+
+    uint64_t now = now_us();
+
+    fputc(kind, w->f);
+    put_varint(w->f, now - w->last_us);
+    put_varint(w->f, conn);
+    if (kind == CAPTURE_FRAME)
+        fwrite(frame, 1, len, w->f);
+
+    /*
+     * Most likely the disk is full. Stop here and say so, otherwise the file
+     * just ends somewhere and we only find out when the replay stops early.
+     */
+    if (ferror(w->f)) {
+        perror("capture: write");
+        fprintf(stderr, "capture: stopped recording, the file is cut off\n");
+        fclose(w->f);
+        w->f = NULL;
+        return;
+    }
+
+    w->last_us = now;
+}
+
+void capture_close(struct capture_writer *w)
+{
+    if (w->f == NULL)
+        return;
+    // fclose() writes out what is still buffered, that can fail too
+    if (fclose(w->f) == EOF)
+        perror("capture: fclose");
+    w->f = NULL;
+}
+
+int capture_reader_open(struct capture_reader *r, const char *path)
+{
+    char magic[CAPTURE_MAGIC_LEN];
+
+    memset(r, 0, sizeof(*r));
+    r->f = fopen(path, "rb");
+    if (r->f == NULL)
+        return -1;
+
+    if (fread(magic, 1, sizeof(magic), r->f) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "capture: %s is not a capture file\n", path);
+        fclose(r->f);
+        r->f = NULL;
+        return -1;
+    }
+
+    r->first = 1;
+    return 0;
+}
+
+int capture_read(struct capture_reader *r, struct capture_event *ev)
+{
+    uint64_t delta, conn;
+
+    int kind = fgetc(r->f);
+    if (kind == EOF)
+        return 0;
+
+    if (kind > CAPTURE_CLOSE || get_varint(r->f, &delta) == -1 ||
+        get_varint(r->f, &conn) == -1 || conn > UINT32_MAX)
+        return -1;
+
+    // the first delta is the time between starting the server and the first
+    // connection, nobody wants to wait for that during a replay
+    if (r->first)
+        delta = 0;
+    r->first = 0;
+    r->time_us += delta;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->kind = kind;
+    ev->time_us = r->time_us;
+    ev->conn = conn;
+
+    if (kind != CAPTURE_FRAME)
+        return 1;
+
+    r->frame.len = 0;
+    if (bytebuf_reserve(&r->frame, PROTO_HDR_LEN) == -1 ||
+        fread(r->frame.data, 1, PROTO_HDR_LEN, r->f) != PROTO_HDR_LEN)
+        return -1;
+    r->frame.len = PROTO_HDR_LEN;
+
+    uint32_t len = proto_get_u32(r->frame.data + 2);
+    // the server never accepts bigger frames than this, so neither do we
+    if (len > PROTO_MAX_CLIENT_FRAME - PROTO_HDR_LEN ||
+        bytebuf_reserve(&r->frame, len) == -1 ||
+        fread(r->frame.data + PROTO_HDR_LEN, 1, len, r->f) != len)
+        return -1;
+    r->frame.len += len;
+
+    ev->type = proto_get_u16(r->frame.data);
+    ev->len = len;
+    ev->frame = r->frame.data;
+    return 1;
+}
+
+void capture_reader_close(struct capture_reader *r)
+{
+    if (r->f != NULL)
+        fclose(r->f);
+    bytebuf_free(&r->frame);
+    memset(r, 0, sizeof(*r));
+}
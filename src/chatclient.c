@@ -0,0 +1,648 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../include/chatclient.h"
+#include "../include/utils.h"
+
+enum session_state {
+    SESSION_WAITING,    // not connected, next attempt at retry_at
+    SESSION_CONNECTING, // non blocking connect() is in progress
+    SESSION_CONNECTED,
+};
+
+struct chat_session {
+    struct chat_loop *loop;
+    char username[USERNAME_LEN];
+    struct chat_callbacks cb;
+    void *user;
+
+    // resolved once, every reconnect walks the list again
+    struct addrinfo *servinfo;
+    struct addrinfo *next_addr;
+
+    int fd;
+    enum session_state state;
+    long retry_at;
+    long backoff;
+    // chat_session_free() was called while the loop was looking at us
+    int dead;
+
+    /*
+     * tx only ever holds whole frames, tx_off is how much of it is already
+     * written. Frames are dropped once they are written completely, so if the
+     * connection breaks in the middle of one it is sent again in full.
+     */
+    struct bytebuf tx;
+    size_t tx_off;
+    struct bytebuf rx;
+};
+
+struct watch {
+    int fd;
+    void (*cb)(int fd, void *user);
+    void *user;
+};
+
+struct chat_loop {
+    struct chat_session **sessions;
+    size_t count;
+    size_t size;
+
+    struct watch *watches;
+    size_t watch_count;
+    size_t watch_size;
+
+    // rebuilt every time, polled[i] is the session behind pfds[i] (or NULL)
+    struct pollfd *pfds;
+    struct chat_session **polled;
+    size_t pfds_size;
+
+    int dispatching;
+    int has_dead;
+    int stop;
+};
+
+static void start_connect(struct chat_session *s);
+static void reap(struct chat_loop *loop);
+
+struct chat_loop *chat_loop_new(void)
+{
+    return calloc(1, sizeof(struct chat_loop));
+}
+
+static void session_destroy(struct chat_session *s)
+{
+    if (s->fd != -1)
+        close(s->fd);
+    freeaddrinfo(s->servinfo);
+    bytebuf_free(&s->tx);
+    bytebuf_free(&s->rx);
+    free(s);
+}
+
+void chat_loop_free(struct chat_loop *loop)
+{
+    if (loop == NULL)
+        return;
+
+    for (size_t i = 0; i < loop->count; i++)
+        session_destroy(loop->sessions[i]);
+    free(loop->sessions);
+    free(loop->watches);
+    free(loop->pfds);
+    free(loop->polled);
+    free(loop);
+}
+
+void chat_loop_stop(struct chat_loop *loop)
+{
+    loop->stop = 1;
+}
+
+int chat_loop_watch_fd(struct chat_loop *loop, int fd,
+                       void (*cb)(int fd, void *user), void *user)
+{
+    if (loop->watch_count == loop->watch_size) {
+        size_t new_size = loop->watch_size ? loop->watch_size * 2 : 4;
+        struct watch *tmp = realloc(loop->watches, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return -1;
+        loop->watches = tmp;
+        loop->watch_size = new_size;
+    }
+
+    loop->watches[loop->watch_count].fd = fd;
+    loop->watches[loop->watch_count].cb = cb;
+    loop->watches[loop->watch_count].user = user;
+    loop->watch_count++;
+    return 0;
+}
+
+void chat_loop_unwatch_fd(struct chat_loop *loop, int fd)
+{
+    for (size_t i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd == fd) {
+            // the slot is cleaned up by reap(), maybe only after dispatching
+            loop->watches[i].fd = -1;
+            loop->has_dead = 1;
+            if (!loop->dispatching)
+                reap(loop);
+            return;
+        }
+    }
+}
+
+struct chat_session *chat_session_new(struct chat_loop *loop, const char *host,
+                                      const char *port, const char *username,
+                                      const struct chat_callbacks *cb,
+                                      void *user)
+{
+    struct addrinfo hints;
+    int status;
+
+    if (loop->count == loop->size) {
+        size_t new_size = loop->size ? loop->size * 2 : 16;
+        struct chat_session **tmp =
+            realloc(loop->sessions, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return NULL;
+        loop->sessions = tmp;
+        loop->size = new_size;
+    }
+
+    struct chat_session *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((status = getaddrinfo(host, port, &hints, &s->servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        free(s);
+        return NULL;
+    }
+
+    s->loop = loop;
+    snprintf(s->username, sizeof(s->username), "%s", username);
+    if (cb != NULL)
+        s->cb = *cb;
+    s->user = user;
+    s->fd = -1;
+    s->backoff = CHAT_BACKOFF_MIN_MS;
+    s->next_addr = s->servinfo;
+    // the first attempt is made by the loop, so callbacks only ever run from
+    // inside chat_loop_run_once()
+    s->state = SESSION_WAITING;
+    s->retry_at = 0;
+
+    loop->sessions[loop->count++] = s;
+    return s;
+}
+
+void chat_session_free(struct chat_session *s)
+{
+    if (s == NULL)
+        return;
+
+    struct chat_loop *loop = s->loop;
+
+    // the loop might still have a pointer to us in polled[], so it frees us
+    // after it is done
+    if (loop->dispatching) {
+        s->dead = 1;
+        loop->has_dead = 1;
+        return;
+    }
+
+    for (size_t i = 0; i < loop->count; i++) {
+        if (loop->sessions[i] == s) {
+            loop->sessions[i] = loop->sessions[--loop->count];
+            break;
+        }
+    }
+    session_destroy(s);
+}
+
+int chat_session_connected(const struct chat_session *s)
+{
+    return s->state == SESSION_CONNECTED;
+}
+
+const char *chat_session_username(const struct chat_session *s)
+{
+    return s->username;
+}
+
+size_t chat_session_pending(const struct chat_session *s)
+{
+    return s->tx.len - s->tx_off;
+}
+
+static int queue_frame(struct chat_session *s, uint16_t type,
+                       const void *payload, uint32_t len)
+{
+    if (s->tx.len + PROTO_HDR_LEN + len > CHAT_MAX_QUEUE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return proto_append_frame(&s->tx, type, payload, len);
+}
+
+int chat_send_message(struct chat_session *s, const char *text)
+{
+    struct chatMessage message;
+
+    memset(&message, 0, sizeof(message));
+    snprintf(message.username, sizeof(message.username), "%s", s->username);
+    snprintf(message.message, sizeof(message.message), "%s", text);
+
+    return queue_frame(s, PROTO_CHAT, &message, sizeof(message));
+}
+
+int chat_send_typing(struct chat_session *s, int typing)
+{
+    unsigned char flag = typing != 0;
+    return queue_frame(s, PROTO_TYPING, &flag, 1);
+}
+
+int chat_send_frame(struct chat_session *s, uint16_t type, const void *payload,
+                    uint32_t len)
+{
+    return queue_frame(s, type, payload, len);
+}
+
+/*
+ * Waits a bit before the next attempt. The wait doubles after every failure
+ * and is randomized so that a few thousand sessions that lost the server at
+ * the same moment don't all come back at the same moment.
+ */
+static void schedule_retry(struct chat_session *s)
+{
+    s->state = SESSION_WAITING;
+    s->next_addr = s->servinfo;
+    s->retry_at = now_ms() + s->backoff / 2 + rand() % (s->backoff / 2 + 1);
+
+    s->backoff *= 2;
+    if (s->backoff > CHAT_BACKOFF_MAX_MS)
+        s->backoff = CHAT_BACKOFF_MAX_MS;
+}
+
+static void disconnect(struct chat_session *s)
+{
+    int was_connected = s->state == SESSION_CONNECTED;
+
+    if (s->fd != -1) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    // whatever was only half written goes out again after the reconnect
+    s->tx_off = 0;
+    s->rx.len = 0;
+
+    schedule_retry(s);
+
+    if (was_connected && s->cb.on_disconnect)
+        s->cb.on_disconnect(s, s->user);
+}
+
+static void connected(struct chat_session *s)
+{
+    struct bytebuf tx = {0};
+
+    s->state = SESSION_CONNECTED;
+    s->backoff = CHAT_BACKOFF_MIN_MS;
+
+    // the hello has to be the first thing the server sees, so it goes in
+    // front of whatever is still queued from before
+    if (proto_append_frame(&tx, PROTO_HELLO, s->username,
+                           strlen(s->username)) == -1 ||
+        bytebuf_append(&tx, s->tx.data, s->tx.len) == -1) {
+        bytebuf_free(&tx);
+        disconnect(s);
+        return;
+    }
+    bytebuf_free(&s->tx);
+    s->tx = tx;
+    s->tx_off = 0;
+
+    if (s->cb.on_connect)
+        s->cb.on_connect(s, s->user);
+}
+
+// tries the addresses one after the other until one connects or is pending
+static void start_connect(struct chat_session *s)
+{
+    for (; s->next_addr != NULL; s->next_addr = s->next_addr->ai_next) {
+        struct addrinfo *p = s->next_addr;
+
+        s->fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                       p->ai_protocol);
+        if (s->fd == -1)
+            continue;
+
+        if (connect(s->fd, p->ai_addr, p->ai_addrlen) == 0) {
+            s->next_addr = p->ai_next;
+            connected(s);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            // poll() tells us when it is done, see finish_connect()
+            s->next_addr = p->ai_next;
+            s->state = SESSION_CONNECTING;
+            return;
+        }
+
+        close(s->fd);
+        s->fd = -1;
+    }
+
+    schedule_retry(s);
+}
+
+static void finish_connect(struct chat_session *s)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+
+    if (err == 0) {
+        connected(s);
+        return;
+    }
+
+    close(s->fd);
+    s->fd = -1;
+    start_connect(s);
+}
+
+static void flush_tx(struct chat_session *s)
+{
+    int failed = 0;
+
+    while (s->tx_off < s->tx.len) {
+        // everything that is queued goes out in one write
+        ssize_t n = send(s->fd, s->tx.data + s->tx_off, s->tx.len - s->tx_off,
+                         MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                failed = 1;
+            break;
+        }
+        s->tx_off += n;
+    }
+
+    /*
+     * Drop the frames that are completely written, also when the send just
+     * failed. The kernel took them, sending them again after the reconnect
+     * would duplicate them.
+     */
+    size_t done = 0;
+    uint16_t type;
+    uint32_t len;
+    const unsigned char *payload;
+    size_t frame;
+
+    while ((frame = proto_parse_frame(s->tx.data + done, s->tx.len - done,
+                                      &type, &payload, &len)) > 0 &&
+           done + frame <= s->tx_off)
+        done += frame;
+
+    bytebuf_consume(&s->tx, done);
+    s->tx_off -= done;
+
+    if (failed)
+        disconnect(s);
+}
+
+static void visit_join(void *ctx, uint32_t id, const char *username)
+{
+    struct chat_session *s = ctx;
+    if (!s->dead && s->cb.on_join)
+        s->cb.on_join(s, id, username, s->user);
+}
+
+static void visit_leave(void *ctx, uint32_t id)
+{
+    struct chat_session *s = ctx;
+    if (!s->dead && s->cb.on_leave)
+        s->cb.on_leave(s, id, s->user);
+}
+
+static void visit_typing(void *ctx, uint32_t id, int typing)
+{
+    struct chat_session *s = ctx;
+    if (!s->dead && s->cb.on_typing)
+        s->cb.on_typing(s, id, typing, s->user);
+}
+
+static void handle_frame(struct chat_session *s, uint16_t type,
+                         const unsigned char *payload, uint32_t len)
+{
+    static const struct presence_visitor visitor = {visit_join, visit_leave,
+                                                     visit_typing};
+
+    switch (type) {
+    case PROTO_CHAT: {
+        struct chatMessage message;
+
+        if (len != sizeof(message))
+            break;
+        memcpy(&message, payload, sizeof(message));
+        message.username[sizeof(message.username) - 1] = '\0';
+        message.message[sizeof(message.message) - 1] = '\0';
+        if (s->cb.on_message)
+            s->cb.on_message(s, &message, s->user);
+        break;
+    }
+    case PROTO_PRESENCE:
+        if (proto_decode_presence(payload, len, &visitor, s) == -1)
+            fprintf(stderr, "chatclient: bad presence frame\n");
+        break;
+    default:
+        // newer server, we just skip what we don't know
+        break;
+    }
+}
+
+static void read_frames(struct chat_session *s)
+{
+    ssize_t n;
+
+    do {
+        if (bytebuf_reserve(&s->rx, 4096) == -1) {
+            disconnect(s);
+            return;
+        }
+        n = recv(s->fd, s->rx.data + s->rx.len, s->rx.cap - s->rx.len, 0);
+        if (n > 0)
+            s->rx.len += n;
+        // a full buffer means there is probably more waiting
+    } while (n > 0 && s->rx.len == s->rx.cap);
+
+    int closed = n == 0 || (n == -1 && errno != EAGAIN &&
+                            errno != EWOULDBLOCK && errno != EINTR);
+
+    /*
+     * The last frames often arrive together with the close, so whatever is
+     * complete gets handled before we look at why recv() stopped.
+     */
+    size_t used = 0, frame;
+    uint16_t type;
+    uint32_t len;
+    const unsigned char *payload;
+
+    while (!s->dead && s->state == SESSION_CONNECTED &&
+           (frame = proto_parse_frame(s->rx.data + used, s->rx.len - used,
+                                      &type, &payload, &len)) > 0) {
+        handle_frame(s, type, payload, len);
+        used += frame;
+    }
+    bytebuf_consume(&s->rx, used);
+
+    if (closed && !s->dead && s->state == SESSION_CONNECTED)
+        disconnect(s);
+}
+
+static int grow_pfds(struct chat_loop *loop, size_t needed)
+{
+    if (needed <= loop->pfds_size)
+        return 0;
+
+    size_t new_size = loop->pfds_size ? loop->pfds_size : 16;
+    while (new_size < needed)
+        new_size *= 2;
+
+    struct pollfd *pfds = realloc(loop->pfds, sizeof(*pfds) * new_size);
+    if (pfds == NULL)
+        return -1;
+    loop->pfds = pfds;
+
+    struct chat_session **polled =
+        realloc(loop->polled, sizeof(*polled) * new_size);
+    if (polled == NULL)
+        return -1;
+    loop->polled = polled;
+
+    loop->pfds_size = new_size;
+    return 0;
+}
+
+static void reap(struct chat_loop *loop)
+{
+    for (size_t i = 0; i < loop->count;) {
+        if (loop->sessions[i]->dead) {
+            session_destroy(loop->sessions[i]);
+            loop->sessions[i] = loop->sessions[--loop->count];
+        } else {
+            i++;
+        }
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd != -1)
+            loop->watches[j++] = loop->watches[i];
+    }
+    loop->watch_count = j;
+    loop->has_dead = 0;
+}
+
+int chat_loop_run_once(struct chat_loop *loop, int timeout_ms)
+{
+    long now = now_ms();
+    size_t n = 0;
+    /*
+     * start_connect() can run on_connect right away and that might create
+     * more sessions or watches. pfds is only big enough for what is there
+     * now, the new ones are polled from the next round on.
+     */
+    size_t watch_count = loop->watch_count;
+    size_t count = loop->count;
+
+    if (grow_pfds(loop, watch_count + count) == -1)
+        return -1;
+
+    loop->dispatching = 1;
+
+    for (size_t i = 0; i < watch_count; i++) {
+        loop->pfds[n].fd = loop->watches[i].fd;
+        loop->pfds[n].events = POLLIN;
+        loop->pfds[n].revents = 0;
+        loop->polled[n++] = NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct chat_session *s = loop->sessions[i];
+
+        if (s->dead)
+            continue;
+
+        if (s->state == SESSION_WAITING && s->retry_at <= now)
+            start_connect(s);
+
+        // on_connect or on_disconnect might have freed the session
+        if (s->dead)
+            continue;
+
+        if (s->state == SESSION_WAITING) {
+            // wake up in time for the retry
+            long left = s->retry_at - now;
+            if (timeout_ms < 0 || left < timeout_ms)
+                timeout_ms = left;
+            continue;
+        }
+
+        loop->pfds[n].fd = s->fd;
+        loop->pfds[n].events = POLLIN;
+        if (s->state == SESSION_CONNECTING || s->tx_off < s->tx.len)
+            loop->pfds[n].events |= POLLOUT;
+        loop->pfds[n].revents = 0;
+        loop->polled[n++] = s;
+    }
+
+    int ready = poll(loop->pfds, n, timeout_ms);
+    if (ready == -1) {
+        loop->dispatching = 0;
+        if (errno == EINTR)
+            return 0;
+        perror("chatclient: poll()");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n && ready > 0; i++) {
+        short revents = loop->pfds[i].revents;
+        struct chat_session *s = loop->polled[i];
+
+        if (revents == 0)
+            continue;
+        ready--;
+
+        if (s == NULL) {
+            struct watch *w = &loop->watches[i];
+            if (w->fd != -1)
+                w->cb(w->fd, w->user);
+            continue;
+        }
+
+        if (s->dead)
+            continue;
+
+        if (s->state == SESSION_CONNECTING) {
+            finish_connect(s);
+            continue;
+        }
+
+        if (revents & (POLLIN | POLLHUP | POLLERR))
+            read_frames(s);
+        if (!s->dead && s->state == SESSION_CONNECTED && (revents & POLLOUT))
+            flush_tx(s);
+    }
+
+    loop->dispatching = 0;
+    if (loop->has_dead)
+        reap(loop);
+    return 0;
+}
+
+int chat_loop_run(struct chat_loop *loop)
+{
+    loop->stop = 0;
+    while (!loop->stop) {
+        if (chat_loop_run_once(loop, -1) == -1)
+            return -1;
+    }
+    return 0;
+}
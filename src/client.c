@@ -1,45 +1,146 @@
 //
 // Created by ole on 25.10.24.
 //
-#include <netdb.h>
-#include <poll.h>
-#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <netinet/in.h>
-
-#include <sys/socket.h>
-#include <sys/types.h>
-
-#include <arpa/inet.h>
-
+#include "../include/chatclient.h"
 #include "../include/utils.h"
 
 // https://beej.us/guide/bgnet/html/index-wide.html#getaddrinfoprepare-to-launch
 // https://beej.us/guide/bgnet/source/examples/client.c
 
-#define PORT "3490"
+/*
+ * All the socket work (connecting, reconnecting, buffering, framing) is done
+ * by the chatclient library, see include/chatclient.h. What is left here is
+ * reading lines from stdin and printing what the server sends us.
+ */
+
+/*
+ * The server only sends ids for leaves and typing, so we remember the names
+ * from the joins.
+ */
+struct member {
+    uint32_t id;
+    char username[USERNAME_LEN];
+};
+
+struct member *members = NULL;
+size_t member_count = 0;
+size_t member_size = 0;
+
+const char *member_name(uint32_t id)
+{
+    for (size_t i = 0; i < member_count; i++) {
+        if (members[i].id == id)
+            return members[i].username;
+    }
+    return "someone";
+}
+
+void on_connect(struct chat_session *s, void *user)
+{
+    (void)user;
+    // the server sends us the whole roster again, forget the old one
+    member_count = 0;
+    printf("client: connected as %s\n", chat_session_username(s));
+}
+
+void on_disconnect(struct chat_session *s, void *user)
+{
+    (void)s;
+    (void)user;
+    printf("client: server has disconnected, trying to reconnect...\n");
+}
+
+void on_message(struct chat_session *s, const struct chatMessage *msg,
+                void *user)
+{
+    (void)s;
+    (void)user;
+    fprintf(stderr, ">> %s:  %s", &msg->username[0], &msg->message[0]);
+}
+
+void on_join(struct chat_session *s, uint32_t id, const char *username,
+             void *user)
+{
+    (void)s;
+    (void)user;
+    if (member_count == member_size) {
+        size_t new_size = member_size ? member_size * 2 : 16;
+        struct member *tmp = realloc(members, sizeof(*tmp) * new_size);
+        if (tmp == NULL) {
+            perror("client: realloc");
+            return;
+        }
+        members = tmp;
+        member_size = new_size;
+    }
+    members[member_count].id = id;
+    snprintf(members[member_count].username, USERNAME_LEN, "%s", username);
+    member_count++;
+
+    fprintf(stderr, "-- %s joined\n", username);
+}
 
-struct chatMessage {
-    char username[32];
-    char message[256];
+void on_leave(struct chat_session *s, uint32_t id, void *user)
+{
+    (void)s;
+    (void)user;
+    for (size_t i = 0; i < member_count; i++) {
+        if (members[i].id == id) {
+            fprintf(stderr, "-- %s left\n", members[i].username);
+            members[i] = members[--member_count];
+            return;
+        }
+    }
+}
+
+void on_typing(struct chat_session *s, uint32_t id, int typing, void *user)
+{
+    (void)s;
+    (void)user;
+    if (typing)
+        fprintf(stderr, "-- %s is typing...\n", member_name(id));
+}
+
+struct stdin_ctx {
+    struct chat_loop *loop;
+    struct chat_session *session;
 };
 
-struct chatMessage message;
+void on_stdin(int fd, void *user)
+{
+    (void)fd;
+    struct stdin_ctx *ctx = user;
+
+    char *msg = custom_getline();
+    if (msg == NULL) {
+        // EOF (ctrl-d), we are done
+        chat_loop_stop(ctx->loop);
+        return;
+    }
 
-void *get_in_addr(struct sockaddr *sa);
+    // while we are disconnected this just waits in the queue
+    if (chat_send_message(ctx->session, msg) == -1)
+        perror("client: send");
+    free(msg);
+}
 
 int main(int argc, char *argv[])
 {
-
-    int status, sockfd, numbytes;
-    struct addrinfo hints, *servinfo, *p;
-    // IPv6 Address string length
-    char s[INET6_ADDRSTRLEN];
+    static const struct chat_callbacks callbacks = {
+        .on_connect = on_connect,
+        .on_disconnect = on_disconnect,
+        .on_message = on_message,
+        .on_join = on_join,
+        .on_leave = on_leave,
+        .on_typing = on_typing,
+    };
 
     if (argc != 3) {
         printf("Usage: \e[1m%s [server host address] [username]\e[0m\n",
@@ -47,178 +148,34 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    char *username = argv[2];
+    // the reconnect backoff uses rand()
+    srand(time(NULL) ^ getpid());
 
-    memset(&hints, 0, sizeof(hints));
-
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    printf("trying to connect to: %s\n", argv[1]);
-    if ((status = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    struct chat_loop *loop = chat_loop_new();
+    if (loop == NULL) {
+        perror("client: chat_loop_new");
         return 1;
     }
 
-    // we loop through all the results and bind to the first one we can
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        /* this creates the client socket */
-        sockfd = 0;
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) ==
-            -1) {
-            perror("client: socket()");
-            continue;
-        }
-        // then we connect to the socket, we just created
-
-        // TODO: ip addr might not be init correctly
-        printf("hostname: %s\n", p->ai_canonname);
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("client: connect()");
-        }
-        break;
+    printf("trying to connect to: %s\n", argv[1]);
+    struct chat_session *session =
+        chat_session_new(loop, argv[1], PORT, argv[2], &callbacks, NULL);
+    if (session == NULL) {
+        chat_loop_free(loop);
+        return 1;
     }
 
-    if (p == NULL) {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
+    struct stdin_ctx ctx = {loop, session};
+    if (chat_loop_watch_fd(loop, STDIN_FILENO, on_stdin, &ctx) == -1) {
+        perror("client: chat_loop_watch_fd");
+        chat_loop_free(loop);
+        return 1;
     }
 
-    // inet_ntop converts the IP address from binary to a readable string
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s,
-              sizeof s);
-    printf("client: connecting to %s on port %s\n", s, PORT);
-
-    // we dont need the linked list anymore so we free it
-    freeaddrinfo(servinfo);
-
-    /*
-     * -- What do we want --
-     *  - Maintain persistent connection with the server
-     *  - Keep receiving messages
-     *
-     * -- What do we need --
-     *  - How can we keep the client "alive" -> Loop
-     *      - Where do we put it
-     *  - When the print statement is in the loop it prints '' all the time.
-     *      - Print statement should only be triggered if there is a message
-     *      - if (message arrived) printf(message)
-     *
-     * -- recv() blocking --
-     *  when recv "blocks" it waits for data to arrive,
-     *  --> Use non blocking?
-     *  What happens while its waiting ? What can we do while it waits ?
-     *
-     *  We cant use scanf() because the program is paused while scanf is waiting
-     * for input
-     *
-     * We want to use poll(), not select() this is apparently the old way
-     *
-     */
-
-    /*
-     * -- this allows for synchronous I/O Multiplexing --
-     * @param fds[]: array of information (sockets to monitor)
-     * @param nfds: count of elements in the array
-     * @param timeout: timeout in milliseconds
-     * poll returns number of elements which have had an event occur
-     */
-
-    /*
-     * this is for polling
-     * we start with 5 connections we can realloc if more are necessary
-     */
-    int fd_count = 2;
-    int fd_size = 5;
-
-    /*
-     * struct pollfd {
-     * int fd;         // the socket descriptor
-     * short events;   // bitmap of events we're interested in
-     * short revents;  // when poll() returns, bitmap of events that occurred
-     * };
-     */
-    struct pollfd *pfds = malloc(sizeof *pfds * fd_size);
-
-    pfds[0].fd = STDIN_FILENO;
-    pfds[0].events = POLLIN; // ready to read something, either user input or
-                             // server output
-
-    pfds[1].fd = sockfd;
-    pfds[1].events = POLLIN | POLLERR;
-
-    while (1) {
-        // https://sysadminsage.com/recv-failure-connection-reset-by-peer/
-        // https://stackoverflow.com/questions/40621899/c-socket-recv-connection-reset-by-peer
-
-        // timeout -1 means wait forever
-        int poll_event = poll(pfds, fd_count, -1);
-
-        // right now it should never time out because timeout is -1
-        if (poll_event == 0)
-            printf("Poll timed out\n");
-        if (poll_event == -1)
-            perror("client: poll()");
-        if (poll_event > 0) {
-            for (int i = 0; i < fd_count; i++) {
-                if (pfds[i].revents & POLLIN && pfds[i].fd == sockfd) {
-                    // we receive the message the server sent
-                    if ((numbytes = recv(pfds[1].fd, &message, sizeof(message),
-                                         0)) == -1) {
-                        switch (errno) {
-                        case (EAGAIN | EWOULDBLOCK):
-                            continue;
-                        case (ENOTSOCK):
-                            fprintf(stderr, "error: this is not a socket: %s",
-                                    strerror(errno));
-                            break;
-                        default:
-                            perror("client: recv");
-                            break;
-                        }
-                    }
-
-                    if (numbytes > 0) {
-                        message.message[numbytes] = '\0';
-                        fprintf(stderr, ">> %s:  %s", &message.username[0],
-                                &message.message[0]);
-                    } else if (numbytes == 0) {
-                        printf("client: server has disconnected\n");
-                        free(pfds);
-                        close(sockfd);
-                        return 0;
-                    }
-                } else if (pfds[i].revents & POLLIN &&
-                           pfds[i].fd == STDIN_FILENO) {
-                    char *msg = custom_getline();
-                    if (msg == NULL) {
-                        fprintf(stderr, "msg is NULL\n");
-                        exit(1);
-                    }
-
-                    strcpy(message.message, msg);
-                    strcpy(message.username, username);
-                    int len = sizeof(message);
-                    // check for EWOULDBLOCK || EAGAIN
-                    // save unsent data and set POLLOUT for next poll() call
-                    if (len > 0) {
-                        if (send(pfds[1].fd, &message, len, 0) == -1) {
-                            perror("client: send");
-                            break;
-                        }
-                    }
-                } else if (pfds[i].revents & POLLERR) {
-                    // how can we check the error value? Errno is not set
-                    fprintf(stderr, "Error occured on device %i", i);
-                }
-            }
-        }
-    }
+    int ret = chat_loop_run(loop);
 
-    free(pfds);
-    close(sockfd);
+    chat_loop_free(loop);
+    free(members);
 
-    return 0;
+    return ret == 0 ? 0 : 1;
 }
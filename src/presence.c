@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/presence.h"
+
+void presence_init(struct presence *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+void presence_free(struct presence *p)
+{
+    free(p->members);
+    free(p->by_fd);
+    free(p->left);
+    bytebuf_free(&p->out);
+    memset(p, 0, sizeof(*p));
+}
+
+static struct presence_member *find_member(struct presence *p, int fd)
+{
+    if (fd < 0 || (size_t)fd >= p->by_fd_size || p->by_fd[fd] == 0)
+        return NULL;
+    return &p->members[p->by_fd[fd] - 1];
+}
+
+int presence_join(struct presence *p, int fd, uint32_t id,
+                  const char *username)
+{
+    if (fd < 0)
+        return -1;
+    // a second hello changes nothing
+    if (find_member(p, fd) != NULL)
+        return 0;
+
+    if ((size_t)fd >= p->by_fd_size) {
+        size_t new_size = p->by_fd_size ? p->by_fd_size : 16;
+        while (new_size <= (size_t)fd)
+            new_size *= 2;
+
+        size_t *tmp = realloc(p->by_fd, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return -1;
+        memset(tmp + p->by_fd_size, 0,
+               sizeof(*tmp) * (new_size - p->by_fd_size));
+        p->by_fd = tmp;
+        p->by_fd_size = new_size;
+    }
+
+    if (p->count == p->size) {
+        size_t new_size = p->size ? p->size * 2 : 16;
+        struct presence_member *tmp =
+            realloc(p->members, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return -1;
+        p->members = tmp;
+        p->size = new_size;
+    }
+
+    struct presence_member *m = &p->members[p->count];
+    memset(m, 0, sizeof(*m));
+    m->fd = fd;
+    m->id = id;
+    snprintf(m->username, sizeof(m->username), "%s", username);
+
+    p->count++;
+    p->by_fd[fd] = p->count;
+    p->pending = 1;
+    return 0;
+}
+
+void presence_leave(struct presence *p, int fd)
+{
+    struct presence_member *m = find_member(p, fd);
+    if (m == NULL)
+        return;
+
+    /*
+     * If nobody was told about the join yet we can just forget about the
+     * member, the join and the leave cancel out.
+     */
+    if (m->announced) {
+        if (p->left_count == p->left_size) {
+            size_t new_size = p->left_size ? p->left_size * 2 : 16;
+            uint32_t *tmp = realloc(p->left, sizeof(*tmp) * new_size);
+            if (tmp != NULL) {
+                p->left = tmp;
+                p->left_size = new_size;
+            }
+        }
+        /*
+         * If there is no room for the leave the others just don't hear about
+         * it, but the member has to go either way, the fd is about to be
+         * closed and handed to the next client.
+         */
+        if (p->left_count < p->left_size) {
+            p->left[p->left_count++] = m->id;
+            p->pending = 1;
+        } else {
+            perror("presence: realloc");
+        }
+    }
+
+    // same trick as del_from_pfds(), move the last member into the hole
+    size_t i = p->by_fd[fd] - 1;
+    p->by_fd[fd] = 0;
+    p->count--;
+    if (i != p->count) {
+        p->members[i] = p->members[p->count];
+        p->by_fd[p->members[i].fd] = i + 1;
+    }
+}
+
+void presence_set_typing(struct presence *p, int fd, int typing)
+{
+    struct presence_member *m = find_member(p, fd);
+    if (m == NULL)
+        return;
+
+    m->typing = typing != 0;
+    if (m->typing != m->typing_sent)
+        p->pending = 1;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int put_joins(struct bytebuf *b, struct presence *p, int only_new)
+{
+    size_t start = b->len;
+    uint32_t n = 0;
+
+    if (bytebuf_put_u32(b, 0) == -1)
+        return -1;
+
+    for (size_t i = 0; i < p->count; i++) {
+        struct presence_member *m = &p->members[i];
+        if (only_new && m->announced)
+            continue;
+
+        uint8_t name_len = strlen(m->username);
+        if (bytebuf_put_u32(b, m->id) == -1 ||
+            bytebuf_put_u8(b, name_len) == -1 ||
+            bytebuf_append(b, m->username, name_len) == -1)
+            return -1;
+        n++;
+    }
+
+    unsigned char *c = b->data + start;
+    c[0] = n >> 24;
+    c[1] = (n >> 16) & 0xff;
+    c[2] = (n >> 8) & 0xff;
+    c[3] = n & 0xff;
+    return 0;
+}
+
+/*
+ * Collects the ids of the members that are typing (want == 1) or stopped
+ * typing (want == 0). For a delta only the ones that changed since the last
+ * flush count, for a roster everyone that is typing right now.
+ */
+static int put_typing(struct bytebuf *b, struct presence *p, uint32_t *ids,
+                      int want, int delta)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < p->count; i++) {
+        struct presence_member *m = &p->members[i];
+        if (m->typing != want)
+            continue;
+        if (delta && m->typing == m->typing_sent)
+            continue;
+        if (!delta && !want)
+            continue;
+        ids[n++] = m->id;
+    }
+
+    qsort(ids, n, sizeof(*ids), cmp_u32);
+    return proto_put_idset(b, ids, n);
+}
+
+static size_t build_frame(struct presence *p, uint32_t *ids, int delta)
+{
+    size_t start;
+
+    if (proto_frame_begin(&p->out, PROTO_PRESENCE, &start) == -1 ||
+        put_joins(&p->out, p, delta) == -1)
+        return 0;
+
+    if (delta) {
+        // left is still NULL when nobody has left yet
+        if (p->left_count > 0)
+            qsort(p->left, p->left_count, sizeof(*p->left), cmp_u32);
+        if (proto_put_idset(&p->out, p->left, p->left_count) == -1)
+            return 0;
+    } else if (proto_put_idset(&p->out, NULL, 0) == -1) {
+        return 0;
+    }
+
+    if (put_typing(&p->out, p, ids, 1, delta) == -1 ||
+        put_typing(&p->out, p, ids, 0, delta) == -1)
+        return 0;
+
+    proto_frame_end(&p->out, start);
+    return p->out.len - start;
+}
+
+void presence_flush(struct presence *p,
+                    int (*send_to)(int fd, const void *buf, size_t len))
+{
+    if (!p->pending)
+        return;
+
+    uint32_t *ids = malloc(sizeof(*ids) * (p->count ? p->count : 1));
+    if (ids == NULL) {
+        perror("presence: malloc");
+        return;
+    }
+
+    /*
+     * pending only says that something happened. Typing on and off or a join
+     * and a leave inside one tick cancel out, then the members that were
+     * already here have nothing to hear about.
+     */
+    size_t announced = 0;
+    int changed = p->left_count > 0;
+    for (size_t i = 0; i < p->count; i++) {
+        struct presence_member *m = &p->members[i];
+        announced += m->announced;
+        if (!m->announced || m->typing != m->typing_sent)
+            changed = 1;
+    }
+    int send_delta = announced && changed;
+
+    /*
+     * Both frames are built once and then sent as is to everyone who needs
+     * them, so a flush costs O(members) no matter how much happened.
+     */
+    p->out.len = 0;
+    size_t delta_len = send_delta ? build_frame(p, ids, 1) : 0;
+    size_t roster_len = announced < p->count ? build_frame(p, ids, 0) : 0;
+    free(ids);
+
+    if ((send_delta && delta_len == 0) ||
+        (announced < p->count && roster_len == 0)) {
+        perror("presence: building frame");
+        return;
+    }
+
+    unsigned char *delta = p->out.data;
+    unsigned char *roster = p->out.data + delta_len;
+
+    for (size_t i = 0; i < p->count; i++) {
+        struct presence_member *m = &p->members[i];
+        // send_to() reports and handles its own errors
+        if (!m->announced)
+            send_to(m->fd, roster, roster_len);
+        else if (send_delta)
+            send_to(m->fd, delta, delta_len);
+    }
+
+    for (size_t i = 0; i < p->count; i++) {
+        p->members[i].announced = 1;
+        p->members[i].typing_sent = p->members[i].typing;
+    }
+    p->left_count = 0;
+    p->pending = 0;
+}
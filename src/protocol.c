@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "../include/protocol.h"
+
+int bytebuf_reserve(struct bytebuf *b, size_t extra)
+{
+    if (b->len + extra <= b->cap)
+        return 0;
+
+    // same idea as add_to_pfds(), double the size until it fits
+    size_t new_cap = b->cap ? b->cap : 64;
+    while (new_cap < b->len + extra)
+        new_cap *= 2;
+
+    unsigned char *tmp = realloc(b->data, new_cap);
+    if (tmp == NULL)
+        return -1;
+
+    b->data = tmp;
+    b->cap = new_cap;
+    return 0;
+}
+
+int bytebuf_append(struct bytebuf *b, const void *src, size_t n)
+{
+    // src may be the data of an empty bytebuf, which is NULL
+    if (n == 0)
+        return 0;
+    if (bytebuf_reserve(b, n) == -1)
+        return -1;
+    memcpy(b->data + b->len, src, n);
+    b->len += n;
+    return 0;
+}
+
+int bytebuf_put_u8(struct bytebuf *b, uint8_t v)
+{
+    return bytebuf_append(b, &v, 1);
+}
+
+int bytebuf_put_u16(struct bytebuf *b, uint16_t v)
+{
+    unsigned char p[2] = {v >> 8, v & 0xff};
+    return bytebuf_append(b, p, sizeof(p));
+}
+
+int bytebuf_put_u32(struct bytebuf *b, uint32_t v)
+{
+    unsigned char p[4] = {v >> 24, (v >> 16) & 0xff, (v >> 8) & 0xff,
+                          v & 0xff};
+    return bytebuf_append(b, p, sizeof(p));
+}
+
+// drops n bytes from the front and moves the rest down
+void bytebuf_consume(struct bytebuf *b, size_t n)
+{
+    if (n >= b->len) {
+        b->len = 0;
+        return;
+    }
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+void bytebuf_free(struct bytebuf *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+uint16_t proto_get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t proto_get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           (uint32_t)p[3];
+}
+
+int proto_frame_begin(struct bytebuf *b, uint16_t type, size_t *start)
+{
+    *start = b->len;
+    if (bytebuf_put_u16(b, type) == -1 || bytebuf_put_u32(b, 0) == -1)
+        return -1;
+    return 0;
+}
+
+void proto_frame_end(struct bytebuf *b, size_t start)
+{
+    uint32_t len = b->len - start - PROTO_HDR_LEN;
+    unsigned char *p = b->data + start + 2;
+
+    p[0] = len >> 24;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+}
+
+int proto_append_frame(struct bytebuf *b, uint16_t type, const void *payload,
+                       uint32_t len)
+{
+    if (bytebuf_reserve(b, PROTO_HDR_LEN + len) == -1)
+        return -1;
+    bytebuf_put_u16(b, type);
+    bytebuf_put_u32(b, len);
+    bytebuf_append(b, payload, len);
+    return 0;
+}
+
+size_t proto_parse_frame(const unsigned char *buf, size_t len, uint16_t *type,
+                         const unsigned char **payload, uint32_t *plen)
+{
+    if (len < PROTO_HDR_LEN)
+        return 0;
+
+    *type = proto_get_u16(buf);
+    *plen = proto_get_u32(buf + 2);
+
+    if (len - PROTO_HDR_LEN < *plen)
+        return 0;
+
+    *payload = buf + PROTO_HDR_LEN;
+    return PROTO_HDR_LEN + *plen;
+}
+
+/*
+ * send() is allowed to send less than we asked for, so we keep going until
+ * everything is out.
+ * https://beej.us/guide/bgnet/html/index-wide.html#sendall
+ */
+int send_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_frame(int fd, uint16_t type, const void *payload, uint32_t len)
+{
+    unsigned char hdr[PROTO_HDR_LEN] = {
+        type >> 8,          type & 0xff,        len >> 24,
+        (len >> 16) & 0xff, (len >> 8) & 0xff, len & 0xff,
+    };
+
+    if (send_all(fd, hdr, sizeof(hdr)) == -1)
+        return -1;
+    return send_all(fd, payload, len);
+}
+
+int proto_put_idset(struct bytebuf *b, const uint32_t *ids, size_t n)
+{
+    size_t list_size = 1 + 4 + 4 * n;
+
+    if (n > 0) {
+        // the bitmap covers every id from the smallest to the largest one
+        uint32_t base = ids[0];
+        uint64_t nbits = (uint64_t)ids[n - 1] - base + 1;
+        uint64_t bitmap_size = 1 + 4 + 4 + (nbits + 7) / 8;
+
+        if (bitmap_size < list_size) {
+            size_t nbytes = (nbits + 7) / 8;
+
+            if (bytebuf_put_u8(b, PROTO_IDSET_BITMAP) == -1 ||
+                bytebuf_put_u32(b, base) == -1 ||
+                bytebuf_put_u32(b, nbits) == -1 ||
+                bytebuf_reserve(b, nbytes) == -1)
+                return -1;
+
+            unsigned char *bits = b->data + b->len;
+            memset(bits, 0, nbytes);
+            for (size_t i = 0; i < n; i++) {
+                uint32_t off = ids[i] - base;
+                bits[off / 8] |= 1 << (off % 8);
+            }
+            b->len += nbytes;
+            return 0;
+        }
+    }
+
+    if (bytebuf_reserve(b, list_size) == -1)
+        return -1;
+    bytebuf_put_u8(b, PROTO_IDSET_LIST);
+    bytebuf_put_u32(b, n);
+    for (size_t i = 0; i < n; i++)
+        bytebuf_put_u32(b, ids[i]);
+    return 0;
+}
+
+/*
+ * Calls cb(ctx, id, arg) for every id in the set at *p and moves *p past it.
+ * Returns -1 if the set does not fit in what is left of the payload.
+ */
+static int decode_idset(const unsigned char **p, const unsigned char *end,
+                        void (*cb)(void *, uint32_t, int), void *ctx, int arg)
+{
+    if (end - *p < 5)
+        return -1;
+
+    uint8_t enc = **p;
+    uint32_t first = proto_get_u32(*p + 1);
+    *p += 5;
+
+    if (enc == PROTO_IDSET_LIST) {
+        if ((size_t)(end - *p) / 4 < first)
+            return -1;
+        for (uint32_t i = 0; i < first; i++) {
+            cb(ctx, proto_get_u32(*p), arg);
+            *p += 4;
+        }
+        return 0;
+    }
+
+    if (enc != PROTO_IDSET_BITMAP || end - *p < 4)
+        return -1;
+
+    uint32_t nbits = proto_get_u32(*p);
+    size_t nbytes = ((uint64_t)nbits + 7) / 8;
+    *p += 4;
+    if ((size_t)(end - *p) < nbytes)
+        return -1;
+
+    for (uint32_t i = 0; i < nbits; i++) {
+        if ((*p)[i / 8] & (1 << (i % 8)))
+            cb(ctx, first + i, arg);
+    }
+    *p += nbytes;
+    return 0;
+}
+
+/*
+ * The visitor callbacks have different signatures, these small shims let
+ * decode_idset() call all of them the same way.
+ */
+struct visit {
+    const struct presence_visitor *v;
+    void *ctx;
+};
+
+static void visit_leave(void *arg, uint32_t id, int unused)
+{
+    (void)unused;
+    struct visit *vis = arg;
+    if (vis->v->on_leave)
+        vis->v->on_leave(vis->ctx, id);
+}
+
+static void visit_typing(void *arg, uint32_t id, int typing)
+{
+    struct visit *vis = arg;
+    if (vis->v->on_typing)
+        vis->v->on_typing(vis->ctx, id, typing);
+}
+
+int proto_decode_presence(const unsigned char *p, size_t len,
+                          const struct presence_visitor *v, void *ctx)
+{
+    const unsigned char *end = p + len;
+    struct visit vis = {v, ctx};
+
+    if (len < 4)
+        return -1;
+    uint32_t joins = proto_get_u32(p);
+    p += 4;
+
+    for (uint32_t i = 0; i < joins; i++) {
+        char username[USERNAME_LEN];
+
+        if (end - p < 5)
+            return -1;
+        uint32_t id = proto_get_u32(p);
+        uint8_t name_len = p[4];
+        p += 5;
+        if (name_len >= USERNAME_LEN || end - p < name_len)
+            return -1;
+
+        memcpy(username, p, name_len);
+        username[name_len] = '\0';
+        p += name_len;
+
+        if (v->on_join)
+            v->on_join(ctx, id, username);
+    }
+
+    if (decode_idset(&p, end, visit_leave, &vis, 0) == -1 ||
+        decode_idset(&p, end, visit_typing, &vis, 1) == -1 ||
+        decode_idset(&p, end, visit_typing, &vis, 0) == -1)
+        return -1;
+
+    return 0;
+}
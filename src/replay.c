@@ -0,0 +1,520 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/capture.h"
+#include "../include/chatclient.h"
+#include "../include/utils.h"
+
+/*
+ * -- replay --
+ *
+ * Plays a capture file from ./server -c back against a server. Every captured
+ * connection gets its own session and its frames are sent at the same
+ * offsets they were received at (divided by the speed-up).
+ *
+ * Frames are held back until their session is connected, connecting is not
+ * what we want to measure. One extra session, the observer, only listens.
+ * Every chat message is remembered with the time it was handed to a connected
+ * session, when the observer gets the broadcast we know how long it took
+ * through the server.
+ *
+ * The throughput numbers stop the clock when the last byte was written to
+ * the server, not when the last frame was queued.
+ *
+ * Usage: replay [-a address] [-s speed-up, 0 = as fast as possible] file
+ *
+ * Not everything can be reproduced exactly: sessions are only connected when
+ * their first frame is due (so connections that never sent anything are
+ * skipped) and a connection that never sent a hello still gets one, the
+ * library always starts with it.
+ */
+
+struct conn {
+    struct chat_session *session;
+    // frames that arrived before the session was connected
+    struct bytebuf held;
+    // chat messages the observer has not seen yet
+    size_t unseen;
+};
+
+struct closing {
+    uint32_t conn;
+    long deadline;
+};
+
+// a chat message on its way to the observer
+struct inflight {
+    uint64_t hash;
+    uint64_t sent_us;
+    uint32_t conn;
+    struct inflight *next;
+};
+
+#define INFLIGHT_BUCKETS 4096
+// how long the observer gets to join before we assume there is no server
+#define CONNECT_TIMEOUT_MS 5000
+
+struct conn *conns = NULL;
+size_t conn_size = 0;
+
+struct closing *closing = NULL;
+size_t closing_count = 0;
+size_t closing_size = 0;
+
+struct inflight *inflight[INFLIGHT_BUCKETS];
+size_t inflight_count = 0;
+
+uint64_t *latencies = NULL;
+size_t latency_count = 0;
+size_t latency_size = 0;
+
+// what was really handed to the sessions, see send_now()
+uint64_t frames = 0;
+uint64_t bytes = 0;
+
+int observer_ready = 0;
+long last_receive = 0;
+
+// FNV-1a over username and message, that is all the observer gets to see
+uint64_t message_hash(const struct chatMessage *msg)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const char *parts[2] = {msg->username, msg->message};
+
+    for (int i = 0; i < 2; i++) {
+        for (const char *c = parts[i]; *c != '\0'; c++) {
+            h ^= (unsigned char)*c;
+            h *= 1099511628211ULL;
+        }
+        // so that "ab" + "c" and "a" + "bc" are different
+        h ^= 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void inflight_add(uint64_t hash, uint64_t sent_us, uint32_t conn)
+{
+    struct inflight *e = malloc(sizeof(*e));
+    if (e == NULL) {
+        perror("replay: malloc");
+        return;
+    }
+    e->hash = hash;
+    e->sent_us = sent_us;
+    e->conn = conn;
+    e->next = NULL;
+
+    // keep the buckets in send order, the oldest match is the right one
+    struct inflight **p = &inflight[hash % INFLIGHT_BUCKETS];
+    while (*p != NULL)
+        p = &(*p)->next;
+    *p = e;
+    inflight_count++;
+}
+
+void on_observer_join(struct chat_session *s, uint32_t id,
+                      const char *username, void *user)
+{
+    (void)s;
+    (void)id;
+    (void)username;
+    (void)user;
+    // the observer is in the roster it gets, so the server knows about us
+    observer_ready = 1;
+}
+
+void on_observer_message(struct chat_session *s, const struct chatMessage *msg,
+                         void *user)
+{
+    (void)s;
+    (void)user;
+    uint64_t hash = message_hash(msg);
+
+    last_receive = now_ms();
+    for (struct inflight **p = &inflight[hash % INFLIGHT_BUCKETS]; *p != NULL;
+         p = &(*p)->next) {
+        if ((*p)->hash != hash)
+            continue;
+
+        struct inflight *e = *p;
+        uint64_t latency = now_us() - e->sent_us;
+        *p = e->next;
+        conns[e->conn].unseen--;
+        free(e);
+        inflight_count--;
+
+        if (latency_count == latency_size) {
+            size_t new_size = latency_size ? latency_size * 2 : 1024;
+            uint64_t *tmp = realloc(latencies, sizeof(*tmp) * new_size);
+            if (tmp == NULL) {
+                perror("replay: realloc");
+                return;
+            }
+            latencies = tmp;
+            latency_size = new_size;
+        }
+        latencies[latency_count++] = latency;
+        return;
+    }
+}
+
+// sends one frame and starts the latency clock if it is a chat message
+void send_now(uint32_t id, uint16_t type, const unsigned char *payload,
+              uint32_t len)
+{
+    struct conn *c = &conns[id];
+
+    if (type == PROTO_CHAT && len == sizeof(struct chatMessage)) {
+        struct chatMessage msg;
+        memcpy(&msg, payload, sizeof(msg));
+        msg.username[sizeof(msg.username) - 1] = '\0';
+        msg.message[sizeof(msg.message) - 1] = '\0';
+        inflight_add(message_hash(&msg), now_us(), id);
+        c->unseen++;
+    }
+
+    if (chat_send_frame(c->session, type, payload, len) == -1) {
+        perror("replay: chat_send_frame");
+        return;
+    }
+    frames++;
+    bytes += PROTO_HDR_LEN + len;
+}
+
+// on_connect of the replayed sessions, user is the captured connection id
+void on_conn_connect(struct chat_session *s, void *user)
+{
+    (void)s;
+    uint32_t id = (uintptr_t)user;
+    struct conn *c = &conns[id];
+    size_t done = 0, frame;
+    uint16_t type;
+    uint32_t len;
+    const unsigned char *payload;
+
+    while ((frame = proto_parse_frame(c->held.data + done, c->held.len - done,
+                                      &type, &payload, &len)) > 0) {
+        send_now(id, type, payload, len);
+        done += frame;
+    }
+    bytebuf_free(&c->held);
+}
+
+struct conn *get_conn(uint32_t id)
+{
+    if (id >= conn_size) {
+        size_t new_size = conn_size ? conn_size : 64;
+        while (new_size <= id)
+            new_size *= 2;
+
+        struct conn *tmp = realloc(conns, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return NULL;
+        memset(tmp + conn_size, 0, sizeof(*tmp) * (new_size - conn_size));
+        conns = tmp;
+        conn_size = new_size;
+    }
+    return &conns[id];
+}
+
+/*
+ * A captured close only means the client was done, so we let the session
+ * write out what it still has queued before we hang up (but not forever).
+ * We also wait until the observer saw its messages: closing a socket with
+ * unread broadcasts in it sends a reset, and the server then loses whatever
+ * it had not read from us yet.
+ */
+void conn_free(struct conn *c)
+{
+    chat_session_free(c->session);
+    c->session = NULL;
+    bytebuf_free(&c->held);
+}
+
+void close_later(uint32_t id)
+{
+    if (closing_count == closing_size) {
+        size_t new_size = closing_size ? closing_size * 2 : 64;
+        struct closing *tmp = realloc(closing, sizeof(*tmp) * new_size);
+        if (tmp == NULL) {
+            conn_free(&conns[id]);
+            return;
+        }
+        closing = tmp;
+        closing_size = new_size;
+    }
+    closing[closing_count].conn = id;
+    closing[closing_count].deadline = now_ms() + 1000;
+    closing_count++;
+}
+
+void reap_closing(void)
+{
+    long now = now_ms();
+
+    for (size_t i = 0; i < closing_count;) {
+        struct conn *c = &conns[closing[i].conn];
+        if ((c->held.len == 0 && chat_session_pending(c->session) == 0 &&
+             c->unseen == 0) ||
+            now >= closing[i].deadline) {
+            conn_free(c);
+            closing[i] = closing[--closing_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+// bytes the replayed sessions still have to write, the observer not counted
+size_t pending_bytes(void)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < conn_size; i++) {
+        if (conns[i].session != NULL)
+            n += conns[i].held.len + chat_session_pending(conns[i].session);
+    }
+    return n;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct chat_callbacks observer_callbacks = {
+        .on_message = on_observer_message,
+        .on_join = on_observer_join,
+    };
+
+    char *host = "127.0.0.1";
+    double speed = 1.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:s:")) != -1) {
+        switch (opt) {
+        case 'a':
+            host = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || speed < 0) {
+        printf("Usage: \e[1m%s [-a server address] [-s speed-up, 0 = as fast "
+               "as possible] [capture file]\e[0m\n",
+               argv[0]);
+        exit(1);
+    }
+
+    struct capture_reader reader;
+    if (capture_reader_open(&reader, argv[optind]) == -1) {
+        perror("replay: capture_reader_open()");
+        exit(1);
+    }
+
+    srand(time(NULL) ^ getpid());
+
+    struct chat_loop *loop = chat_loop_new();
+    if (loop == NULL) {
+        perror("replay: chat_loop_new");
+        exit(1);
+    }
+
+    struct chat_session *observer = chat_session_new(
+        loop, host, PORT, "replay-observer", &observer_callbacks, NULL);
+    if (observer == NULL)
+        exit(1);
+
+    long connect_start = now_ms();
+    while (!observer_ready) {
+        if (now_ms() - connect_start >= CONNECT_TIMEOUT_MS) {
+            fprintf(stderr, "replay: could not reach server at %s\n", host);
+            exit(1);
+        }
+        if (chat_loop_run_once(loop, 100) == -1)
+            exit(1);
+    }
+
+    static const struct chat_callbacks conn_callbacks = {
+        .on_connect = on_conn_connect,
+    };
+
+    struct capture_event ev;
+    uint64_t events = 0, hellos = 0, capture_us = 0;
+    uint64_t start = now_us();
+    int ret;
+
+    while ((ret = capture_read(&reader, &ev)) == 1) {
+        events++;
+        capture_us = ev.time_us;
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)(ev.time_us / speed);
+            uint64_t now;
+
+            while ((now = now_us()) < due) {
+                if (chat_loop_run_once(loop, (due - now + 999) / 1000) == -1)
+                    exit(1);
+                reap_closing();
+            }
+        }
+        /*
+         * Also when we are late or not pacing at all, otherwise the frames
+         * only pile up in the queues and the server sees them in big bursts
+         * long after they were "sent".
+         */
+        if (chat_loop_run_once(loop, 0) == -1)
+            exit(1);
+        reap_closing();
+
+        struct conn *c = get_conn(ev.conn);
+        if (c == NULL) {
+            perror("replay: realloc");
+            exit(1);
+        }
+
+        if (ev.kind == CAPTURE_CLOSE) {
+            if (c->session != NULL)
+                close_later(ev.conn);
+            continue;
+        }
+        if (ev.kind != CAPTURE_FRAME)
+            continue;
+
+        const unsigned char *payload = ev.frame + PROTO_HDR_LEN;
+
+        if (c->session == NULL) {
+            char username[USERNAME_LEN];
+            int is_hello = ev.type == PROTO_HELLO && ev.len > 0 &&
+                           ev.len < USERNAME_LEN;
+
+            if (is_hello) {
+                memcpy(username, payload, ev.len);
+                username[ev.len] = '\0';
+            } else {
+                snprintf(username, sizeof(username), "replay%u", ev.conn);
+            }
+
+            c->session = chat_session_new(loop, host, PORT, username,
+                                          &conn_callbacks,
+                                          (void *)(uintptr_t)ev.conn);
+            if (c->session == NULL)
+                exit(1);
+            // the library sends the hello itself
+            if (is_hello) {
+                hellos++;
+                continue;
+            }
+        }
+
+        if (chat_session_connected(c->session) && c->held.len == 0) {
+            send_now(ev.conn, ev.type, payload, ev.len);
+        } else if (bytebuf_append(&c->held, ev.frame,
+                                  PROTO_HDR_LEN + ev.len) == -1) {
+            perror("replay: realloc");
+            exit(1);
+        }
+    }
+
+    if (ret == -1)
+        fprintf(stderr, "replay: capture file is broken, stopping early\n");
+
+    /*
+     * Everything is queued, now wait until it is also written. If the server
+     * stops reading for 2 seconds we give up and report what we have.
+     */
+    size_t pending = pending_bytes();
+    long last_progress = now_ms();
+
+    while (pending > 0 && now_ms() - last_progress < 2000) {
+        if (chat_loop_run_once(loop, 100) == -1)
+            exit(1);
+        reap_closing();
+
+        size_t left = pending_bytes();
+        if (left < pending)
+            last_progress = now_ms();
+        pending = left;
+    }
+
+    uint64_t sent_done = now_us();
+
+    // wait for the rest to arrive, or until nothing happened for 2 seconds
+    last_receive = now_ms();
+    while ((inflight_count > 0 || closing_count > 0) &&
+           now_ms() - last_receive < 2000) {
+        if (chat_loop_run_once(loop, 100) == -1)
+            exit(1);
+        reap_closing();
+    }
+
+    double replay_ms = (sent_done - start) / 1000.0;
+    double secs = replay_ms > 0 ? replay_ms / 1000.0 : 0.001;
+
+    printf("replay: %llu events, %llu frames, %llu bytes (captured hellos are "
+           "not counted, the library sends its own %llu)\n",
+           (unsigned long long)events, (unsigned long long)frames,
+           (unsigned long long)bytes, (unsigned long long)hellos);
+    printf("replay: capture spans %.1f ms, sending took %.1f ms\n",
+           capture_us / 1000.0, replay_ms);
+    if (pending > 0)
+        printf("replay: the server stopped reading, %zu bytes were never "
+               "written\n",
+               pending);
+    printf("replay: %.0f frames/s, %.1f KiB/s\n", frames / secs,
+           bytes / 1024.0 / secs);
+    if (speed > 0) {
+        // the last byte was written this long after the capture said so
+        double behind_ms = replay_ms - capture_us / speed / 1000.0;
+        printf("replay: finished %.3f ms behind schedule\n",
+               behind_ms > 0 ? behind_ms : 0);
+    }
+
+    if (latency_count > 0) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < latency_count; i++)
+            sum += latencies[i];
+        qsort(latencies, latency_count, sizeof(*latencies), cmp_u64);
+
+        printf("replay: chat latency over %zu messages: avg %.3f ms, p50 "
+               "%.3f ms, p99 %.3f ms, max %.3f ms\n",
+               latency_count, sum / 1000.0 / latency_count,
+               latencies[latency_count / 2] / 1000.0,
+               latencies[latency_count * 99 / 100] / 1000.0,
+               latencies[latency_count - 1] / 1000.0);
+    }
+    if (inflight_count > 0)
+        printf("replay: %zu chat messages never arrived\n", inflight_count);
+
+    for (size_t i = 0; i < INFLIGHT_BUCKETS; i++) {
+        while (inflight[i] != NULL) {
+            struct inflight *e = inflight[i];
+            inflight[i] = e->next;
+            free(e);
+        }
+    }
+    chat_loop_free(loop);
+    capture_reader_close(&reader);
+    for (size_t i = 0; i < conn_size; i++)
+        bytebuf_free(&conns[i].held);
+    free(conns);
+    free(closing);
+    free(latencies);
+
+    return inflight_count == 0 && ret == 0 ? 0 : 1;
+}
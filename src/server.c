@@ -1,8 +1,10 @@
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,26 +14,67 @@
 #include <unistd.h>
 #include <wait.h>
 
+#include "../include/capture.h"
+#include "../include/presence.h"
+#include "../include/protocol.h"
 #include "../include/utils.h"
 
 // https://beej.us/guide/bgnet/source/examples/server.c
 // https://beej.us/guide/bgnet/html/index-wide.html#getaddrinfoprepare-to-launch
 
-#define BACKLOG 10
-#define PORT "3490"
-
-struct chatMessage {
-    char username[32];
-    char message[256];
+// a restart makes every client reconnect at once, with a tiny queue most of
+// them get dropped and sit in the kernels SYN retry timer for seconds
+#define BACKLOG SOMAXCONN
+// how long presence events are collected before they go out, in ms
+#define DEFAULT_TICK_MS 100
+// a client that has this much waiting for it is not reading, so we drop it
+#define CLIENT_MAX_QUEUE (1024 * 1024)
+// read this much per recv(), clients write everything they queued at once
+#define RECV_SIZE (64 * 1024)
+
+/*
+ * Everything we know about one connection, looked up by its fd.
+ * rx holds what we received but could not use yet because the frame is not
+ * complete, tx what we want to send but the socket did not take yet. Client
+ * sockets are non blocking, so one slow client can't stall everybody else.
+ */
+struct client {
+    uint32_t id;
+    struct bytebuf rx;
+    struct bytebuf tx;
+    // set when sending failed, the main loop drops the client
+    int dead;
 };
 
-struct chatMessage message;
+struct client *clients = NULL;
+size_t clients_size = 0;
+
+struct presence presence;
+// only open with -c, capture_record() does nothing otherwise
+struct capture_writer capture;
+
+// cleared by SIGINT / SIGTERM so we can close the capture file properly
+volatile sig_atomic_t running = 1;
 
 void *get_in_addr(struct sockaddr *sa);
 void add_to_pfds(struct pollfd *pfds[], int newfd, int *fd_count, int *fd_size);
 void del_from_pfds(struct pollfd *pfds[], int i, int *fd_count);
-
-int main(void)
+struct client *add_client(int fd, uint32_t id);
+void del_client(int fd);
+void drop_client(struct pollfd *pfds[], int i, int *fd_count);
+int queue_to_client(int fd, const void *buf, size_t len);
+int queue_frame_to_client(int fd, uint16_t type, const void *payload,
+                          uint32_t len);
+int flush_client(int fd);
+void stop_handler(int s);
+size_t handle_frames(int fd, const unsigned char *buf, size_t len,
+                     struct pollfd *pfds, int fd_count, int *bad_frame);
+int take_input(int fd, const unsigned char *buf, size_t len,
+               struct pollfd *pfds, int fd_count);
+int handle_frame(int fd, uint16_t type, const unsigned char *payload,
+                 uint32_t len, struct pollfd *pfds, int fd_count);
+
+int main(int argc, char *argv[])
 {
     // We start linstening on sockfd (sockfd), and all new connection go on
     // new_fd
@@ -51,6 +94,42 @@ int main(void)
 
     // sigaction, "action to be taken when a signal arrives"
     struct sigaction sa;
+
+    // presence events are sent out in batches, one batch every tick_ms
+    long tick_ms = DEFAULT_TICK_MS;
+    long next_tick = -1;
+    uint32_t next_id = 1;
+    char *capture_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:c:")) != -1) {
+        switch (opt) {
+        case 't':
+            tick_ms = strtol(optarg, NULL, 10);
+            if (tick_ms <= 0) {
+                fprintf(stderr, "server: tick has to be > 0 ms\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            capture_path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-t presence tick in ms] [-c capture file]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // record every frame we receive so it can be replayed later, see
+    // include/capture.h
+    if (capture_path != NULL && capture_open(&capture, capture_path) == -1) {
+        perror("server: capture_open()");
+        exit(EXIT_FAILURE);
+    }
+
+    presence_init(&presence);
     // This will make sure that the hints struct is empty before using it
     memset(&hints, 0, sizeof(hints));
 
@@ -216,6 +295,18 @@ int main(void)
         exit(EXIT_FAILURE);
     }
 
+    /*
+     * No SA_RESTART here, we want poll() to return with EINTR so the loop
+     * sees that running was cleared.
+     */
+    sa.sa_handler = stop_handler;
+    sa.sa_flags = 0;
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGTERM, &sa, NULL) == -1) {
+        perror("sigaction()");
+        exit(EXIT_FAILURE);
+    }
+
     printf("server: waiting for connections...\n");
 
     /*
@@ -238,18 +329,35 @@ int main(void)
 
     // NOTE: Right now we try get it working for one client. Expand to n later
 
-    while (1) {
-        int poll_event = poll(pfds, fd_count, -1);
+    while (running) {
+        /*
+         * Without pending presence events we can sleep until something
+         * happens, otherwise we have to wake up in time for the next tick.
+         */
+        int timeout = -1;
+        if (next_tick != -1) {
+            long left = next_tick - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+
+        int poll_event = poll(pfds, fd_count, timeout);
         if (poll_event == -1) {
+            if (errno == EINTR)
+                continue;
             perror("server: poll()");
             exit(EXIT_FAILURE);
         }
 
-        if (poll_event == 0)
-            perror("server: poll()"); // poll time out
-
         for (int i = 0; i < fd_count; i++) {
-            if (pfds[i].revents & POLLIN) {
+            if (pfds[i].fd != sockfd && clients[pfds[i].fd].dead)
+                continue;
+
+            if (pfds[i].revents & POLLOUT) {
+                if (flush_client(pfds[i].fd) == -1)
+                    continue;
+            }
+
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
                 if (pfds[i].fd == sockfd) {
                     addr_size = sizeof(client_addr);
                     new_fd = accept(sockfd, (struct sockaddr *)&client_addr,
@@ -257,53 +365,83 @@ int main(void)
 
                     if (new_fd == -1) {
                         perror("server: accept()");
+                    } else if (fcntl(new_fd, F_SETFL, O_NONBLOCK) == -1 ||
+                               add_client(new_fd, next_id++) == NULL) {
+                        perror("server: add_client()");
+                        close(new_fd);
                     } else {
                         add_to_pfds(&pfds, new_fd, &fd_count, &fd_size);
-                        /*
-                        char *msg = "Welcome on the [Websocket]";
-                        int len = strlen(msg);
-                        if (send(new_fd, msg, len , 0) == -1)
-                        {
-                            perror("server: send");
-                            break;
-                        }
-                        */
+                        capture_record(&capture, CAPTURE_OPEN,
+                                       clients[new_fd].id, NULL, 0);
                     }
                 } else {
-                    int nbytes = recv(pfds[i].fd, &message, sizeof(message), 0);
-
-                    if (nbytes <= 0) {
+                    int fd = pfds[i].fd;
+
+                    /*
+                     * One buffer for everyone, only the piece of a frame that
+                     * is cut off at the end is kept per client.
+                     */
+                    static unsigned char recv_buf[RECV_SIZE];
+                    int nbytes = recv(fd, recv_buf, sizeof(recv_buf), 0);
+                    // set when the client broke the protocol, recv was fine
+                    int bad_frame = nbytes > 0 &&
+                                    take_input(fd, recv_buf, nbytes, pfds,
+                                               fd_count) == -1;
+
+                    // the socket is non blocking, poll() was just early
+                    if (nbytes == -1 &&
+                        (errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == EINTR))
+                        continue;
+
+                    if (nbytes <= 0 || bad_frame) {
                         if (nbytes == 0) {
-                            printf("Socket %d hung up.\n", pfds[i].fd);
-                        } else {
+                            printf("Socket %d hung up.\n", fd);
+                        } else if (nbytes == -1) {
                             perror("server: recv");
                         }
-                        close(pfds[i].fd);
-                        del_from_pfds(&pfds, i, &fd_count);
-                    } else {
-                        message.message[nbytes] = '\0';
-                        // We want to broadcast the message sent from client x
-                        // to every client except x. this means tho that we want
-                        // to loop through every socket connected not just the
-                        // latest socket
-
-                        int len = sizeof(message);
-
-                        printf("user: %s \nmsg: %s", &message.username[0],
-                               &message.message[0]);
-                        for (int j = 1; j < fd_count; j++) {
-                            if (pfds[j].fd != pfds[i].fd) {
-                                if (send(pfds[j].fd, &message, len, 0) == -1) {
-                                    perror("server: send");
-                                    break;
-                                }
-                            }
-                        }
+                        drop_client(&pfds, i, &fd_count);
+                        // the last pollfd was moved to i, look at it again
+                        i--;
                     }
                 }
             }
         }
+
+        if (presence.pending && next_tick == -1)
+            next_tick = now_ms() + tick_ms;
+
+        if (next_tick != -1 && now_ms() >= next_tick) {
+            presence_flush(&presence, queue_to_client);
+            next_tick = -1;
+        }
+
+        /*
+         * Drop the clients that could not keep up and only ask for POLLOUT
+         * where something is waiting, a socket is almost always writable and
+         * poll() would never sleep otherwise.
+         */
+        for (int i = 1; i < fd_count; i++) {
+            struct client *c = &clients[pfds[i].fd];
+            if (c->dead) {
+                drop_client(&pfds, i, &fd_count);
+                i--;
+                continue;
+            }
+            pfds[i].events = c->tx.len > 0 ? POLLIN | POLLOUT : POLLIN;
+        }
+    }
+
+    printf("server: shutting down\n");
+    for (int i = 1; i < fd_count; i++) {
+        del_client(pfds[i].fd);
+        close(pfds[i].fd);
     }
+    close(sockfd);
+    free(pfds);
+    free(clients);
+    capture_close(&capture);
+    presence_free(&presence);
     return 0;
 }
 
@@ -339,7 +477,9 @@ void add_to_pfds(struct pollfd *pfds[], int new_fd, int *fd_count, int *fd_size)
      */
 
     (*pfds)[*fd_count].fd = new_fd;
-    (*pfds)[*fd_count].events = POLLIN | POLLOUT;
+    (*pfds)[*fd_count].events = POLLIN;
+    // we might be called from inside the loop over pfds
+    (*pfds)[*fd_count].revents = 0;
 
     (*fd_count)++;
 }
@@ -367,7 +507,289 @@ void del_from_pfds(struct pollfd *pfds[], int i, int *fd_count)
      * loop
      */
 
-    pfds[i] = pfds[*fd_count - 1];
+    (*pfds)[i] = (*pfds)[*fd_count - 1];
 
     (*fd_count)--;
 }
+
+/*
+ * Returns the state for a new connection. The array is indexed by fd and grows
+ * the same way as pfds does in add_to_pfds().
+ */
+struct client *add_client(int fd, uint32_t id)
+{
+    if ((size_t)fd >= clients_size) {
+        size_t new_size = clients_size ? clients_size : 16;
+        while (new_size <= (size_t)fd)
+            new_size *= 2;
+
+        struct client *tmp = realloc(clients, sizeof(*tmp) * new_size);
+        if (tmp == NULL)
+            return NULL;
+        memset(tmp + clients_size, 0,
+               sizeof(*tmp) * (new_size - clients_size));
+        clients = tmp;
+        clients_size = new_size;
+    }
+
+    clients[fd].id = id;
+    clients[fd].rx.len = 0;
+    clients[fd].tx.len = 0;
+    clients[fd].dead = 0;
+    return &clients[fd];
+}
+
+void del_client(int fd)
+{
+    bytebuf_free(&clients[fd].rx);
+    bytebuf_free(&clients[fd].tx);
+    clients[fd].id = 0;
+    clients[fd].dead = 0;
+}
+
+// everything that has to happen when a connection at pfds[i] goes away
+void drop_client(struct pollfd *pfds[], int i, int *fd_count)
+{
+    int fd = (*pfds)[i].fd;
+
+    capture_record(&capture, CAPTURE_CLOSE, clients[fd].id, NULL, 0);
+    presence_leave(&presence, fd);
+    del_client(fd);
+    close(fd);
+    del_from_pfds(pfds, i, fd_count);
+}
+
+/*
+ * Sends as much as the socket takes right now and keeps the rest in the
+ * client's tx, the main loop writes it once poll() says POLLOUT.
+ * Returns -1 (and marks the client dead) if the client has to be dropped.
+ */
+int queue_to_client(int fd, const void *buf, size_t len)
+{
+    struct client *c = &clients[fd];
+    const unsigned char *p = buf;
+
+    if (c->dead)
+        return -1;
+
+    // nothing is waiting in front of us, so we can try to send right away
+    if (c->tx.len == 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            perror("server: send");
+            c->dead = 1;
+            return -1;
+        }
+        if (n > 0) {
+            p += n;
+            len -= n;
+        }
+    }
+
+    if (len == 0)
+        return 0;
+
+    if (c->tx.len + len > CLIENT_MAX_QUEUE) {
+        fprintf(stderr, "Socket %d is not reading, dropping it\n", fd);
+        c->dead = 1;
+        return -1;
+    }
+    if (bytebuf_append(&c->tx, p, len) == -1) {
+        perror("server: queue");
+        c->dead = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int queue_frame_to_client(int fd, uint16_t type, const void *payload,
+                          uint32_t len)
+{
+    unsigned char hdr[PROTO_HDR_LEN] = {
+        type >> 8,          type & 0xff,        len >> 24,
+        (len >> 16) & 0xff, (len >> 8) & 0xff, len & 0xff,
+    };
+
+    // if only the header fits the client is dropped anyway, so it never
+    // sees half a frame
+    if (queue_to_client(fd, hdr, sizeof(hdr)) == -1)
+        return -1;
+    return queue_to_client(fd, payload, len);
+}
+
+// writes what is waiting in tx, called when poll() says POLLOUT
+int flush_client(int fd)
+{
+    struct client *c = &clients[fd];
+
+    while (c->tx.len > 0) {
+        ssize_t n = send(fd, c->tx.data, c->tx.len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("server: send");
+            c->dead = 1;
+            return -1;
+        }
+        bytebuf_consume(&c->tx, n);
+    }
+    return 0;
+}
+
+/*
+ * Handles the complete frames at the start of buf and returns how many bytes
+ * they took. A header that announces a frame bigger than a client may send
+ * sets *bad_frame right away, there is no point in waiting for the rest.
+ */
+size_t handle_frames(int fd, const unsigned char *buf, size_t len,
+                     struct pollfd *pfds, int fd_count, int *bad_frame)
+{
+    size_t used = 0, frame;
+    uint16_t type;
+    uint32_t plen;
+    const unsigned char *payload;
+
+    for (;;) {
+        if (len - used >= PROTO_HDR_LEN &&
+            proto_get_u32(buf + used + 2) > sizeof(struct chatMessage)) {
+            fprintf(stderr, "Socket %d: frame too big\n", fd);
+            *bad_frame = 1;
+            break;
+        }
+
+        frame = proto_parse_frame(buf + used, len - used, &type, &payload,
+                                  &plen);
+        if (frame == 0)
+            break;
+
+        capture_record(&capture, CAPTURE_FRAME, clients[fd].id, buf + used,
+                       frame);
+        if (handle_frame(fd, type, payload, plen, pfds, fd_count) == -1) {
+            *bad_frame = 1;
+            break;
+        }
+        used += frame;
+    }
+    return used;
+}
+
+/*
+ * Feeds what recv() got to the frame handling. Frames are handled straight
+ * from buf, only a frame that is cut off at the end is copied into the
+ * client's rx and finished with the next recv(). Frames that get that far
+ * are at most PROTO_MAX_CLIENT_FRAME, so rx never grows beyond that.
+ * Returns -1 if the client sent something it should not have.
+ */
+int take_input(int fd, const unsigned char *buf, size_t len,
+               struct pollfd *pfds, int fd_count)
+{
+    struct client *c = &clients[fd];
+    size_t off = 0;
+    int bad_frame = 0;
+
+    // first finish what is left over from last time
+    while (c->rx.len > 0 && off < len) {
+        size_t take = PROTO_MAX_CLIENT_FRAME - c->rx.len;
+        if (take > len - off)
+            take = len - off;
+        if (bytebuf_append(&c->rx, buf + off, take) == -1) {
+            perror("server: bytebuf_append");
+            return -1;
+        }
+        off += take;
+
+        size_t used = handle_frames(fd, c->rx.data, c->rx.len, pfds, fd_count,
+                                    &bad_frame);
+        if (bad_frame)
+            return -1;
+        bytebuf_consume(&c->rx, used);
+    }
+
+    if (off < len) {
+        off += handle_frames(fd, buf + off, len - off, pfds, fd_count,
+                             &bad_frame);
+        if (bad_frame)
+            return -1;
+        if (bytebuf_append(&c->rx, buf + off, len - off) == -1) {
+            perror("server: bytebuf_append");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Does whatever a complete frame from fd asks for.
+ * Returns -1 if the frame makes no sense and the connection should be dropped.
+ */
+int handle_frame(int fd, uint16_t type, const unsigned char *payload,
+                 uint32_t len, struct pollfd *pfds, int fd_count)
+{
+    switch (type) {
+    case PROTO_HELLO: {
+        char username[USERNAME_LEN];
+
+        if (len == 0 || len >= USERNAME_LEN)
+            return -1;
+        memcpy(username, payload, len);
+        username[len] = '\0';
+
+        printf("Socket %d is %s (id %u)\n", fd, username, clients[fd].id);
+        // a second hello from the same client is just ignored, but a client
+        // that can't be put into the room would be invisible for good
+        if (presence_join(&presence, fd, clients[fd].id, username) == -1) {
+            perror("server: presence_join");
+            return -1;
+        }
+        return 0;
+    }
+
+    case PROTO_TYPING:
+        if (len != 1)
+            return -1;
+        presence_set_typing(&presence, fd, payload[0]);
+        return 0;
+
+    case PROTO_CHAT: {
+        struct chatMessage message;
+
+        if (len != sizeof(message))
+            return -1;
+        memcpy(&message, payload, sizeof(message));
+        // we can't trust the client to terminate the strings
+        message.username[sizeof(message.username) - 1] = '\0';
+        message.message[sizeof(message.message) - 1] = '\0';
+
+        // sending a message means you are done typing it
+        presence_set_typing(&presence, fd, 0);
+
+        printf("user: %s \nmsg: %s", &message.username[0],
+               &message.message[0]);
+
+        // We want to broadcast the message sent from client x to every
+        // client except x. this means tho that we want to loop through
+        // every socket connected not just the latest socket
+        for (int j = 1; j < fd_count; j++) {
+            if (pfds[j].fd != fd) {
+                // errors are handled by dropping the client later
+                queue_frame_to_client(pfds[j].fd, PROTO_CHAT, &message,
+                                      sizeof(message));
+            }
+        }
+        return 0;
+    }
+
+    default:
+        fprintf(stderr, "Socket %d: unknown frame type %u\n", fd, type);
+        return -1;
+    }
+}
+
+void stop_handler(int s)
+{
+    (void)s;
+    running = 0;
+}
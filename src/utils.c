@@ -85,3 +85,19 @@ char *custom_getline(void)
     }
     return line;
 }
+
+// milliseconds from a clock that never jumps, only good for measuring time
+long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// same clock as now_ms(), for when milliseconds are not precise enough
+uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}